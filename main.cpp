@@ -12,6 +12,7 @@
 // - output is produced in subdir results/
 //    results/synthesized.slab.vox is the synthesized labeling
 //    results/synthesized_detailed.slab.vox is the output using detailed tiles
+// - run with -server for interactive editing (commands on stdin, see serve3D)
 //
 // For more details on model synthesis:
 // - http://graphics.stanford.edu/~pmerrell/
@@ -63,6 +64,16 @@ THE SOFTWARE.
 #include <queue>
 #include <limits>
 #include <cstring>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdio>
+#include <cerrno>
 
 // --------------------------------------------------------------
 
@@ -86,6 +97,33 @@ string tilemap = "castle";
 // synthesize a periodic structure? (only makes sense if not using borders!)
 const bool  periodic = false;
 
+// random seed (all random streams derive from it, see Rng)
+unsigned long long seed = 0;
+
+// number of candidate syntheses of each sub-domain (1: no portfolio, see synthesize_portfolio)
+int         portfolio_size = 1;
+// number of threads running the candidates (does not change results)
+int         num_threads = 1;
+
+// number of passes of solve3D, increases on larger domains
+int         num_passes = sz;
+// number of sub-domains synthesized per pass (twice that on ground level)
+int         num_sub_synth = 32;
+
+// checkpointing of solve3D (see CheckpointWriter)
+// seconds between checkpoints (0: after every pass, < 0: disabled)
+double      checkpoint_every = -1;
+// resume solve3D from the last checkpoint?
+bool        resume = false;
+
+// draw box sizes by their measured gain, stop on convergence (see AdaptiveSchedule)
+bool        adaptive = false;
+// time budget of solve3D in seconds (< 0: none)
+double      time_budget = -1;
+
+// place sub-domains according to past attempts (see PlacementHeatmap)
+bool        guided = false;
+
 // --------------------------------------------------------------
 
 // number of labels in problem
@@ -121,29 +159,6 @@ map<int, uchar>          id2pal;  // label id to palette index
 
 /* -------------------------------------------------------- */
 
-// This prepares the small data structure 'allowed_by_side' from 'constraints'
-// to allow for a faster check in 'updateConstraintsAtSite'
-void prepareFastConstraintChecks()
-{
-  allowed_by_side.allocate(6);
-  ForIndex(n, 6) {
-    allowed_by_side[n].allocate(num_lbls);
-    ForIndex(l1, num_lbls) {
-      bool allowed = false;
-      ForIndex(l2, num_lbls) {
-        int a = l1; int b = l2;
-        if (side[n]) { std::swap(a, b); }
-        bool can_be_side_by_side = (constraints.at(a, b) & face[n]);
-        if (can_be_side_by_side) {
-          allowed_by_side[n][l1].push_back(l2);
-        }
-      }
-    }
-  }
-}
-
-// --------------------------------------------------------------
-
 // Returns the opposite neighbor, used in 'updateConstraintsAtSite'
 inline int oppositeNeighbor(int n)
 {
@@ -180,6 +195,10 @@ public:
     else   { m_Values[n >> s_PowNumBits] &= ~(1 << (n & s_ModNumBits)); } 
   }
   void fill(bool b) { memset(m_Values, b ? 0xFF : 0x00, c_MaxLabelFields * sizeof(uint)); }
+  // direct access to the bit field, 32 labels per word
+  static int numWords()       { return c_MaxLabelFields; }
+  uint       word(int w) const { return m_Values[w]; }
+  uint&      word(int w)       { return m_Values[w]; }
 };
 
 // --------------------------------------------------------------
@@ -207,6 +226,187 @@ inline void andEq(Presence& a, const Presence& b)
 
 /* -------------------------------------------------------- */
 
+// same as 'allowed_by_side' the other way around: labels that can be next
+// to a given label along a side (supported_by_side[n][l2] has l1 if
+// allowed_by_side[n][l1] contains l2)
+Array< Array<Presence> > supported_by_side;
+// labels of the problem (bits beyond num_lbls are unused)
+Presence       label_mask;
+// incremented every time the constraints change
+int            problem_generation = 0;
+
+// This prepares the small data structures 'allowed_by_side' and 'supported_by_side'
+// from 'constraints' to allow for a faster check in 'updateConstraintsAtSite'
+void prepareFastConstraintChecks()
+{
+  allowed_by_side.allocate(6);
+  ForIndex(n, 6) {
+    allowed_by_side[n].allocate(num_lbls);
+    ForIndex(l1, num_lbls) {
+      ForIndex(l2, num_lbls) {
+        int a = l1; int b = l2;
+        if (side[n]) { std::swap(a, b); }
+        bool can_be_side_by_side = (constraints.at(a, b) & face[n]);
+        if (can_be_side_by_side) {
+          allowed_by_side[n][l1].push_back(l2);
+        }
+      }
+    }
+  }
+  // labels in use
+  label_mask.fill(false);
+  ForIndex(l, num_lbls) {
+    label_mask.set(l, true);
+  }
+  // labels supported by each single label along each side
+  // (bits beyond num_lbls are set, so that and-ing leaves them untouched)
+  sl_assert(Presence::numWords() == 2 && num_lbls <= 64); // as expected by SupportCache
+  supported_by_side.allocate(6);
+  ForIndex(n, 6) {
+    supported_by_side[n].allocate(num_lbls);
+    ForIndex(l2, num_lbls) {
+      ForIndex(w, Presence::numWords()) {
+        supported_by_side[n][l2].word(w) = ~label_mask.word(w);
+      }
+    }
+    ForIndex(l1, num_lbls) {
+      for (int l2 : allowed_by_side[n][l1]) {
+        supported_by_side[n][l2].set(l1, true);
+      }
+    }
+  }
+  // cached supports are now invalid
+  problem_generation++;
+}
+
+/* -------------------------------------------------------- */
+
+// Counters of the support cache, gathered from all threads
+std::atomic<long long> support_cache_direct(0); // single label neighbors
+std::atomic<long long> support_cache_hits(0);   // multi-label neighbors, found in cache
+std::atomic<long long> support_cache_misses(0); // multi-label neighbors, computed
+
+// Caches the set of labels supported by a neighbor, for each side and each
+// neighbor Presence. Neighbor presences repeat a lot: most sites either hold
+// a single label (direct lookup in 'supported_by_side') or the full soup.
+// Other presences go through a small open addressing hash table, where a
+// new entry replaces an old one when the probe sequence is full.
+// There is one cache per thread, reset when the problem changes.
+class SupportCache
+{
+private:
+  static const int c_NumEntries = 1024; // per side, power of two
+  static const int c_MaxProbes  = 4;
+  struct Entry
+  {
+    bool     used;
+    uint     key[2];
+    Presence supported;
+  };
+  vector<Entry> m_Entries;
+  int           m_Generation;
+  long long     m_Direct, m_Hits, m_Misses;
+
+  static uint hash(const uint *key)
+  {
+    uint h = key[0] * 0x9E3779B1u ^ (key[1] * 0x85EBCA77u + 0x165667B1u);
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    return h ^ (h >> 13);
+  }
+
+  // index of the single bit in a word
+  static int bitIndex(uint w)
+  {
+    int i = 0;
+    if ((w & 0xFFFF) == 0) { i += 16; w >>= 16; }
+    if ((w & 0x00FF) == 0) { i +=  8; w >>=  8; }
+    if ((w & 0x000F) == 0) { i +=  4; w >>=  4; }
+    if ((w & 0x0003) == 0) { i +=  2; w >>=  2; }
+    if ((w & 0x0001) == 0) { i +=  1; }
+    return i;
+  }
+
+  void reset()
+  {
+    m_Entries.assign(6 * c_NumEntries, Entry());
+    ForIndex(e, (int)m_Entries.size()) { m_Entries[e].used = false; }
+    m_Generation = problem_generation;
+  }
+
+public:
+  SupportCache() : m_Generation(-1), m_Direct(0), m_Hits(0), m_Misses(0) { }
+  ~SupportCache() { flushStats(); }
+
+  // adds the counters of this thread to the global ones
+  void flushStats()
+  {
+    support_cache_direct += m_Direct;
+    support_cache_hits   += m_Hits;
+    support_cache_misses += m_Misses;
+    m_Direct = m_Hits = m_Misses = 0;
+  }
+
+  // Labels supported by presence 'neigh' along side n. Bits beyond
+  // num_lbls are set, so that and-ing leaves them untouched.
+  const Presence& supported(int n, const Presence& neigh)
+  {
+    if (m_Generation != problem_generation) {
+      reset();
+    }
+    uint key[2] = { neigh.word(0) & label_mask.word(0), neigh.word(1) & label_mask.word(1) };
+    // single label?
+    if ((key[0] == 0) != (key[1] == 0)) {
+      uint w = key[0] | key[1];
+      if ((w & (w - 1)) == 0) {
+        m_Direct++;
+        return supported_by_side[n][bitIndex(w) + (key[0] == 0 ? 32 : 0)];
+      }
+    }
+    // look up
+    Entry *table = &m_Entries[n * c_NumEntries];
+    uint h = hash(key);
+    ForIndex(p, c_MaxProbes) {
+      Entry& e = table[(h + p) & (c_NumEntries - 1)];
+      if (!e.used) break;
+      if (e.key[0] == key[0] && e.key[1] == key[1]) {
+        m_Hits++;
+        return e.supported;
+      }
+    }
+    // compute
+    m_Misses++;
+    Presence sup;
+    sup.word(0) = ~label_mask.word(0);
+    sup.word(1) = ~label_mask.word(1);
+    ForIndex(l2, num_lbls) { // (bits beyond num_lbls are set in all entries)
+      if (neigh[l2]) {
+        const Presence& s2 = supported_by_side[n][l2];
+        sup.word(0) |= s2.word(0);
+        sup.word(1) |= s2.word(1);
+      }
+    }
+    // insert in the first free slot, or replace the first one
+    Entry *slot = &table[h & (c_NumEntries - 1)];
+    ForIndex(p, c_MaxProbes) {
+      Entry& e = table[(h + p) & (c_NumEntries - 1)];
+      if (!e.used) {
+        slot = &e;
+        break;
+      }
+    }
+    slot->used      = true;
+    slot->key[0]    = key[0];
+    slot->key[1]    = key[1];
+    slot->supported = sup;
+    return slot->supported;
+  }
+};
+
+thread_local SupportCache support_cache;
+
+/* -------------------------------------------------------- */
+
 // Updates the set of possible labels at a given site (voxel i,j,k), considering the n-th neighbor.
 // Returns whether something changed, and whether all labels disappeared due to over-constraints (failed).
 // This is a local update used in the global 'propagateConstraints' function below.
@@ -223,25 +423,23 @@ void updateConstraintsAtSite(int i, int j, int k, int n, Array3D<Presence>& _S,
     }
   }
 
-  _changed = false;
+  // labels supported by the neighbor (see SupportCache)
   const Presence& from_neigh = _S.at<Wrap>(i + neighs[n][0], j + neighs[n][1], k + neighs[n][2]);
-  ForIndex(l1, num_lbls) {
-    if (_S.at(i, j, k)[l1]) {
-      bool allowed = false;
-      int num = (int)allowed_by_side[n][l1].size();
-      ForIndex(t, num) {
-        int l2 = allowed_by_side[n][l1][t];
-        allowed = allowed || from_neigh[l2];
-      }
-      if (!allowed) {
-        _changed = true;
-        _S.at(i, j, k).set(l1,false);
-      }
-    }
+  const Presence& supported  = support_cache.supported(n, from_neigh);
+  // remove labels that are not
+  Presence& here = _S.at(i, j, k);
+  _changed       = false;
+  bool empty     = true;
+  ForIndex(w, Presence::numWords()) {
+    uint before = here.word(w);
+    here.word(w) &= supported.word(w);
+    // only labels of the problem count
+    _changed = _changed || (((here.word(w) ^ before) & label_mask.word(w)) != 0);
+    empty    = empty && ((here.word(w) & label_mask.word(w)) == 0);
   }
 
   // is the selection empty?
-  if (isFalse(_S.at(i,j,k))) { // yes ...
+  if (empty) { // yes ...
     _failed = true;
   } else {
     _failed = false;
@@ -350,7 +548,9 @@ bool init_global_empty(Array3D<Presence>& S, int lbl_empty,int lbl_ground=-1)
 // constraints are propagated inside.
 // Returns true on success, false otherwise (i.e. constraints cannot be resolved).
 // The domain is changed, even on failure. Caller is responsible for restoring it.
-bool reinit_sub(Array3D<Presence>& S, int lbl_empty, AAB<3, int> sub)
+// If pinned is given, sites marked as pinned keep their label and constrain
+// the soup around them.
+bool reinit_sub(Array3D<Presence>& S, int lbl_empty, AAB<3, int> sub, const Array3D<uchar> *pinned = NULL)
 {
   // init: reset subset, propagate constraints from borders
   v3i cri = sub.minCorner();
@@ -358,11 +558,25 @@ bool reinit_sub(Array3D<Presence>& S, int lbl_empty, AAB<3, int> sub)
   ForRange(k, cri[2] + 1, cra[2] - 1) {
     ForRange(j, cri[1] + 1, cra[1] - 1) {
       ForRange(i, cri[0] + 1, cra[0] - 1) {
-        S.at(i, j, k).fill(true);
+        if (pinned == NULL || !pinned->at(i, j, k)) {
+          S.at(i, j, k).fill(true);
+        }
       }
     }
   }
   bool ok = true;
+  if (pinned != NULL) {
+    // pinned sites inside
+    ForRange(k, cri[2] + 1, cra[2] - 1) {
+      ForRange(j, cri[1] + 1, cra[1] - 1) {
+        ForRange(i, cri[0] + 1, cra[0] - 1) {
+          if (pinned->at(i, j, k)) {
+            ok &= propagateConstraints(i, j, k, S);
+          }
+        }
+      }
+    }
+  }
   ForRange(k, cri[2], cra[2]) {
     ForRange(i, cri[0], cra[0]) {
       ok &= propagateConstraints(i, cri[1], k, S);
@@ -402,16 +616,62 @@ int num_solids_sub(Array3D<Presence>& S, int lbl_empty, AAB<3, int> sub)
 
 /* -------------------------------------------------------- */
 
+// Counter based random generator: the i-th number of a stream is the
+// SplitMix64 finalizer applied to the stream key plus i times the golden ratio.
+// A stream is identified by the seed and three integers, for instance
+// (pass, attempt, candidate), so any stream can be created on any thread,
+// in any order, and always produces the same numbers. This is what makes
+// results independent of the number of threads.
+class Rng
+{
+private:
+  unsigned long long m_Key;
+  unsigned long long m_Counter;
+
+  static unsigned long long finalize(unsigned long long z)
+  {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+  static unsigned long long combine(unsigned long long key, int v)
+  {
+    return finalize(key ^ ((unsigned long long)(unsigned int)v * 0x9E3779B97F4A7C15ull + 0x632BE59BD9B4E019ull));
+  }
+
+public:
+  Rng(unsigned long long seed, int a, int b, int c) : m_Counter(0)
+  {
+    m_Key = combine(combine(combine(finalize(seed), a), b), c);
+  }
+  // returns a positive integer, like rand()
+  int next()
+  {
+    m_Counter++;
+    return (int)(finalize(m_Key + m_Counter * 0x9E3779B97F4A7C15ull) >> 33);
+  }
+};
+
+/* -------------------------------------------------------- */
+
 // Main synthesis function
 // Performs synthesis within the sub domain given as a box, or the full domain
 // if no sub domain is specified.
 // Returns true on success, false otherwise (i.e. constraints cannot be resolved).
 // The domain is changed, even on failure. Caller is responsible for restoring it.
 // After a success _num_solids contains the number of synthesized non empty labels.
+// All random choices (scan order, choices) are drawn from rnd.
+// If cancel is given, synthesis gives up (returns false) as soon as it becomes true.
+// If solid_budget is given, synthesis also gives up as soon as the result
+// cannot reach that many non empty labels (the caller would reject it anyway),
+// in which case _bounded is set.
 bool synthesize(
   Array3D<Presence>& S,
   int lbl_empty, int& _num_solids,
-  AAB<3, int> sub = AAB<3, int>())
+  Rng& rnd,
+  AAB<3, int> sub = AAB<3, int>(),
+  const std::atomic<bool> *cancel = NULL,
+  int solid_budget = -1, bool *_bounded = NULL)
 {
   // buffer for choices
   int choices[1024];
@@ -432,15 +692,15 @@ bool synthesize(
   // randomize scanline order
   int order[] = { 0, 1, 2 };
   ForIndex(p, 9) {
-    int a = rand() % 3;
-    int b = rand() % 3;
+    int a = rnd.next() % 3;
+    int b = rnd.next() % 3;
     std::swap(order[a],order[b]);
   }
   v3i starts = box.minCorner();
   v3i ends   = box.maxCorner();
   int sign[] = { 1, 1, 1 };
   ForIndex(p, 3) {
-    sign[p] = 1 - 2 * (rand() & 1);
+    sign[p] = 1 - 2 * (rnd.next() & 1);
   }
   ForIndex(p, 3) {
     if (sign[p] < 0) {
@@ -449,11 +709,47 @@ bool synthesize(
     ends[p] += sign[p];
   }
 
+  // Upper bound on the final number of solids: solids placed so far, plus
+  // the sites not visited yet that can still receive a non empty label.
+  // The count of such sites is refreshed at each new slab, and only
+  // decremented in between (sites may lose their non empty choices without
+  // being noticed, which keeps the bound valid).
+  if (_bounded != NULL) {
+    *_bounded = false;
+  }
+  Presence solid_mask;
+  solid_mask = label_mask;
+  solid_mask.set(lbl_empty, false);
+  auto maySolid = [&solid_mask](const Presence& pr) {
+    return ((pr.word(0) & solid_mask.word(0)) | (pr.word(1) & solid_mask.word(1))) != 0;
+  };
+  auto countMaySolid = [&](int slab) { // sites of this slab and of the next ones
+    int num = 0;
+    ForRange(k, box.minCorner()[2], box.maxCorner()[2]) {
+      ForRange(j, box.minCorner()[1], box.maxCorner()[1]) {
+        ForRange(i, box.minCorner()[0], box.maxCorner()[0]) {
+          int c = v3i(i, j, k)[order[2]];
+          if ((c - slab) * sign[order[2]] >= 0 && maySolid(S.at(i, j, k))) {
+            num++;
+          }
+        }
+      }
+    }
+    return num;
+  };
+  int num_may_solid = solid_budget >= 0 ? countMaySolid(starts[order[2]]) : 0;
+
   // propagate until done or conflict
   v3i cur = starts;
   bool failed = false;
   while (!failed) {
 
+    // cancelled?
+    if (cancel != NULL && cancel->load(std::memory_order_relaxed)) {
+      failed = true;
+      break;
+    }
+
     cur[order[0]] += sign[order[0]];
     if (cur[order[0]] == ends[order[0]]) {
       cur[order[0]] = starts[order[0]];
@@ -464,6 +760,10 @@ bool synthesize(
         if (cur[order[2]] == ends[order[2]]) {
           break;
         }
+        // new slab, refresh the bound
+        if (solid_budget >= 0) {
+          num_may_solid = countMaySolid(cur[order[2]]);
+        }
       }
     }
 
@@ -482,8 +782,12 @@ bool synthesize(
     if (num_choices == 0) {
       failed = true;
     }
+    // site is now visited
+    if (solid_budget >= 0 && maySolid(S.at(cur[0], cur[1], cur[2]))) {
+      num_may_solid--;
+    }
     // random choice
-    int r = rand() % num_choices;
+    int r = rnd.next() % num_choices;
     int c = choices[r];
     S.at(cur[0], cur[1], cur[2]).fill(false);
     S.at(cur[0], cur[1], cur[2]).set(c,true);
@@ -497,6 +801,14 @@ bool synthesize(
       failed = true;
     }
 
+    // can we still reach the budget?
+    if (!failed && _num_solids + num_may_solid < solid_budget) {
+      failed = true;
+      if (_bounded != NULL) {
+        *_bounded = true;
+      }
+    }
+
   } // main update loop
 
   if (failed) {
@@ -582,36 +894,46 @@ void load3DProblem(const char *fname)
 
 /* -------------------------------------------------------- */
 
-// Saves a voxel file (.slab.vox format, can be imported by MagicaVoxel)
-void saveAsVox(const char *fname,const Array3D<Presence>& S)
+// Saves a voxel grid of palette indices (.slab.vox format, can be imported by MagicaVoxel)
+void saveVoxels(const char *fname, const Array3D<uchar>& voxels, const Array<v3b>& pal)
 {
   FILE *f;
   f = fopen(fname, "wb");
   sl_assert(f != NULL);
-  long sx = S.xsize(), sy = S.ysize(), sz = S.zsize();
+  long sx = voxels.xsize(), sy = voxels.ysize(), sz = voxels.zsize();
   fwrite(&sx, 4, 1, f);
   fwrite(&sy, 4, 1, f);
   fwrite(&sz, 4, 1, f);
   ForIndex(i, sx) {
     ForIndex(j, sy) {
       ForRangeReverse(k, sz-1, 0) {
-        int id = -1;
-        ForIndex(l, num_lbls) {
-          if (S.at(i, j, k)[l]) {
-            id = l;
-            break;
-          }
-        }
-        sl_assert(id > -1);
-        uchar pal = id2pal[id];
-        fwrite(&pal, sizeof(uchar), 1, f);
+        fwrite(&voxels.at(i, j, k), sizeof(uchar), 1, f);
       }
     }
   }
-  fwrite(palette.raw(), sizeof(v3b), 256, f);
+  fwrite(pal.raw(), sizeof(v3b), 256, f);
   fclose(f);
 }
 
+// Saves a voxel file (.slab.vox format, can be imported by MagicaVoxel)
+void saveAsVox(const char *fname,const Array3D<Presence>& S)
+{
+  Array3D<uchar> voxels;
+  voxels.allocate(S.xsize(), S.ysize(), S.zsize());
+  ForArray3D(S, i, j, k) {
+    int id = -1;
+    ForIndex(l, num_lbls) {
+      if (S.at(i, j, k)[l]) {
+        id = l;
+        break;
+      }
+    }
+    sl_assert(id > -1);
+    voxels.at(i, j, k) = id2pal[id];
+  }
+  saveVoxels(fname, voxels, palette);
+}
+
 /* -------------------------------------------------------- */
 
 // Saves a voxel file (.slab.vox format, can be imported by MagicaVoxel)
@@ -713,6 +1035,677 @@ void saveAsVoxDetailed(
 
 /* -------------------------------------------------------- */
 
+// Copies the sub domain (border included) of S into _B
+void extract_sub(const Array3D<Presence>& S, AAB<3, int> sub, Array3D<Presence>& _B)
+{
+  v3i cri = sub.minCorner();
+  v3i cra = sub.maxCorner();
+  _B.allocate(cra[0] - cri[0] + 1, cra[1] - cri[1] + 1, cra[2] - cri[2] + 1);
+  ForArray3D(_B, i, j, k) {
+    _B.at(i, j, k) = S.at(cri[0] + i, cri[1] + j, cri[2] + k);
+  }
+}
+
+// Copies back a sub domain extracted with 'extract_sub'
+void paste_sub(const Array3D<Presence>& B, AAB<3, int> sub, Array3D<Presence>& _S)
+{
+  v3i cri = sub.minCorner();
+  ForArray3D(B, i, j, k) {
+    _S.at(cri[0] + i, cri[1] + j, cri[2] + k) = B.at(i, j, k);
+  }
+}
+
+/* -------------------------------------------------------- */
+
+// Persistent worker threads, so that their thread local state (e.g. the
+// support cache) carries over from one job to the next. A job is run by
+// every worker and by the calling thread, dispatch returns once all are done.
+class WorkerPool
+{
+private:
+  vector<std::thread>     m_Threads;
+  std::mutex              m_Mutex;
+  std::condition_variable m_Start;
+  std::condition_variable m_Done;
+  std::function<void()>   m_Job;
+  int                     m_Generation;
+  int                     m_Busy;
+  bool                    m_Quit;
+
+  void run()
+  {
+    int seen = 0;
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Start.wait(lock, [&]() { return m_Generation != seen || m_Quit; });
+        if (m_Quit) break;
+        seen = m_Generation;
+        job  = m_Job;
+      }
+      job();
+      support_cache.flushStats();
+      {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (--m_Busy == 0) m_Done.notify_one();
+      }
+    }
+  }
+
+public:
+  WorkerPool(int num_workers) : m_Generation(0), m_Busy(0), m_Quit(false)
+  {
+    ForIndex(t, num_workers) {
+      m_Threads.push_back(std::thread([this]() { run(); }));
+    }
+  }
+  ~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Quit = true;
+    }
+    m_Start.notify_all();
+    for (auto& th : m_Threads) {
+      th.join();
+    }
+  }
+  int numWorkers() const { return (int)m_Threads.size(); }
+  void dispatch(const std::function<void()>& job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Job  = job;
+      m_Busy = numWorkers();
+      m_Generation++;
+    }
+    m_Start.notify_all();
+    job(); // this thread takes part
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Done.wait(lock, [this]() { return m_Busy == 0; });
+    m_Job = nullptr;
+  }
+};
+
+// workers of synthesize_portfolio, created on first use
+std::unique_ptr<WorkerPool> portfolio_pool;
+
+// Speculative synthesis of a single sub domain: 'portfolio_size' candidates
+// each synthesize a private copy of the sub domain (and its border) with
+// their own random stream, hence their own scan order and choices.
+// Candidates run on 'num_threads' threads (see WorkerPool). The candidate with the lowest
+// index among those accepted by the solids test (at least num_solids_before
+// non empty labels) wins: once a candidate is accepted, candidates with a
+// higher index are cancelled, while lower ones run to completion. The
+// result thus does not depend on the number of threads or their timings.
+// Returns true on success, in which case S is updated. S is left unchanged
+// otherwise: if no candidate met a contradiction, _rejected tells whether
+// some completed with fewer solids than num_solids_before, _bounded whether
+// all gave up early (the early bound is loose, so the count is checked here).
+// The private copies do not wrap around, this is only for non periodic
+// synthesis.
+bool synthesize_portfolio(Array3D<Presence>& S, int lbl_empty, AAB<3, int> sub, int num_solids_before, int pass, int attempt, bool& _bounded, bool& _rejected)
+{
+  _bounded  = false;
+  _rejected = false;
+  // private copy of the sub domain and its border, in local coordinates
+  Array3D<Presence> B;
+  extract_sub(S, sub, B);
+  AAB<3, int> local;
+  local.minCorner() = v3i(0, 0, 0);
+  local.maxCorner() = sub.maxCorner() - sub.minCorner();
+  // resetting is deterministic, do it once for all candidates
+  if (!reinit_sub(B, lbl_empty, local)) {
+    return false; // reinit failed: cannot work here
+  }
+  // race!
+  const int num_candidates = portfolio_size;
+  std::unique_ptr<std::atomic<bool>[]> cancel(new std::atomic<bool>[num_candidates]);
+  ForIndex(c, num_candidates) {
+    cancel[c] = false;
+  }
+  std::atomic<int> next_candidate(0);
+  std::atomic<int> winner(num_candidates);
+  std::atomic<int> num_contradictions(0);
+  std::atomic<int> num_short(0);
+  vector<Array3D<Presence> > results(num_candidates);
+  auto work = [&]() {
+    while (true) {
+      int c = next_candidate++;
+      if (c >= num_candidates || c > winner) break;
+      results[c] = B;
+      // stream 0 is used by solve3D for placement
+      Rng  rnd(seed, pass, attempt, 1 + c);
+      int  num_solids;
+      bool bounded;
+      bool done = synthesize(results[c], lbl_empty, num_solids, rnd, local, &cancel[c], num_solids_before, &bounded);
+      if (done && num_solids >= num_solids_before) {
+        // keep the lowest accepted candidate, cancel the ones after it
+        int w = winner;
+        while (c < w && !winner.compare_exchange_weak(w, c)) { }
+        ForRange(o, c + 1, num_candidates - 1) {
+          cancel[o] = true;
+        }
+      } else if (done) {
+        num_short++; // completed, but not enough solids
+      } else if (!bounded && !cancel[c]) {
+        num_contradictions++;
+      }
+    }
+  };
+  int num_workers = min(num_threads, num_candidates) - 1;
+  if (num_workers > 0) {
+    if (!portfolio_pool || portfolio_pool->numWorkers() != num_workers) {
+      portfolio_pool.reset(new WorkerPool(num_workers));
+    }
+    portfolio_pool->dispatch(work);
+  } else {
+    work();
+  }
+  if (winner == num_candidates) {
+    _rejected = (num_contradictions == 0 && num_short > 0);
+    _bounded  = (num_contradictions == 0 && num_short == 0);
+    return false;
+  }
+  paste_sub(results[winner], sub, S);
+  return true;
+}
+
+/* -------------------------------------------------------- */
+
+// Loads the problem (files in subdirectory exemplars/)
+void loadProblem()
+{
+  string fullpath = string(SRC_PATH "/exemplars/") + problem + ".slab.vox";
+  load3DProblem(fullpath.c_str());
+}
+
+// Initializes the volume as empty, with a ground if the problem uses one
+void initVolume(Array3D<Presence>& S)
+{
+  S.allocate(sz, sz, sz);
+  if (pal2id.find(254) != pal2id.end()) {
+    // ground is being used
+    init_global_empty(S, pal2id[255], pal2id[254]);
+  } else {
+    // no ground: use an empty border along all faces
+    init_global_empty(S, pal2id[255]);
+  }
+}
+
+// Outputs the result, and its detailed version if a tilemap exists
+void saveResults(const Array3D<Presence>& S)
+{
+  // output final
+  saveAsVox(SRC_PATH "/results/synthesized.slab.vox", S);
+  // output detailed if a tilemap exists
+  string low = (string(SRC_PATH "/exemplars/") + tilemap + ".slab.vox");
+  string detailed = (string(SRC_PATH "/exemplars/") + tilemap + "_detailed.slab.vox");
+  if (LibSL::System::File::exists(detailed.c_str())) {
+    saveAsVoxDetailed(
+      low.c_str(),
+      detailed.c_str(),
+      SRC_PATH "/results/synthesized_detailed.slab.vox",
+      S);
+  }
+}
+
+/* -------------------------------------------------------- */
+
+// Hash of the loaded problem (labels and constraints) and volume size.
+// A checkpoint can only be resumed for the same problem.
+unsigned long long problemHash()
+{
+  unsigned long long h = 14695981039346656037ull; // FNV-1a
+  auto mix = [&h](int v) {
+    ForIndex(b, 4) {
+      h ^= (v >> (b * 8)) & 255;
+      h *= 1099511628211ull;
+    }
+  };
+  mix(sz); mix(periodic); mix(num_lbls);
+  ForIndex(l, num_lbls) {
+    mix(id2pal[l]);
+  }
+  ForIndex(j, num_lbls) { ForIndex(i, num_lbls) {
+    mix(constraints.at(i, j));
+  } }
+  return h;
+}
+
+// State of solve3D between two passes
+struct Checkpoint
+{
+  unsigned long long problem_hash;
+  unsigned long long seed;
+  int                pass;        // next pass to run
+  int                num_failed;
+  int                num_success;
+  int                num_attempts;
+  int                num_improvements;
+  int                num_contradictions;
+  int                num_bounded;
+  int                num_rejected;
+  int                sx, sy, sz;
+  vector<uchar>      labels;      // label id of each site (volume is fully determined)
+};
+
+static const uint c_CheckpointMagic   = 0x43534D56; // 'VMSC'
+static const int  c_CheckpointVersion = 3;
+
+template <typename T> void checkpointPut(vector<uchar>& _buf, const T& v)
+{
+  const uchar *ptr = (const uchar*)&v;
+  _buf.insert(_buf.end(), ptr, ptr + sizeof(T));
+}
+
+template <typename T> bool checkpointGet(const vector<uchar>& buf, size_t& _pos, T& _v)
+{
+  if (_pos + sizeof(T) > buf.size()) return false;
+  memcpy(&_v, &buf[_pos], sizeof(T));
+  _pos += sizeof(T);
+  return true;
+}
+
+// Serializes a checkpoint, followed by a checksum of its content
+void serializeCheckpoint(const Checkpoint& cp, vector<uchar>& _buf)
+{
+  _buf.clear();
+  checkpointPut(_buf, c_CheckpointMagic);
+  checkpointPut(_buf, c_CheckpointVersion);
+  checkpointPut(_buf, cp.problem_hash);
+  checkpointPut(_buf, cp.seed);
+  checkpointPut(_buf, cp.pass);
+  checkpointPut(_buf, cp.num_failed);
+  checkpointPut(_buf, cp.num_success);
+  checkpointPut(_buf, cp.num_attempts);
+  checkpointPut(_buf, cp.num_improvements);
+  checkpointPut(_buf, cp.num_contradictions);
+  checkpointPut(_buf, cp.num_bounded);
+  checkpointPut(_buf, cp.num_rejected);
+  checkpointPut(_buf, cp.sx);
+  checkpointPut(_buf, cp.sy);
+  checkpointPut(_buf, cp.sz);
+  _buf.insert(_buf.end(), cp.labels.begin(), cp.labels.end());
+  unsigned long long sum = 0;
+  for (uchar c : _buf) { sum = sum * 31 + c; }
+  checkpointPut(_buf, sum);
+}
+
+// Reads back a serialized checkpoint, returns false if invalid
+bool deserializeCheckpoint(const vector<uchar>& buf, Checkpoint& _cp)
+{
+  size_t pos = 0;
+  uint magic;
+  if (!checkpointGet(buf, pos, magic) || magic != c_CheckpointMagic) return false;
+  if (buf.size() < pos + sizeof(unsigned long long)) return false;
+  // checksum
+  size_t end = buf.size() - sizeof(unsigned long long);
+  unsigned long long sum = 0;
+  ForIndex(i, end) { sum = sum * 31 + buf[i]; }
+  pos = end;
+  unsigned long long stored;
+  checkpointGet(buf, pos, stored);
+  if (stored != sum) return false;
+  // content
+  pos = sizeof(uint);
+  int version;
+  bool ok = checkpointGet(buf, pos, version) && version == c_CheckpointVersion
+    && checkpointGet(buf, pos, _cp.problem_hash)
+    && checkpointGet(buf, pos, _cp.seed)
+    && checkpointGet(buf, pos, _cp.pass)
+    && checkpointGet(buf, pos, _cp.num_failed)
+    && checkpointGet(buf, pos, _cp.num_success)
+    && checkpointGet(buf, pos, _cp.num_attempts)
+    && checkpointGet(buf, pos, _cp.num_improvements)
+    && checkpointGet(buf, pos, _cp.num_contradictions)
+    && checkpointGet(buf, pos, _cp.num_bounded)
+    && checkpointGet(buf, pos, _cp.num_rejected)
+    && checkpointGet(buf, pos, _cp.sx)
+    && checkpointGet(buf, pos, _cp.sy)
+    && checkpointGet(buf, pos, _cp.sz);
+  if (!ok || _cp.sx <= 0 || _cp.sy <= 0 || _cp.sz <= 0) return false;
+  size_t num = (size_t)_cp.sx * _cp.sy * _cp.sz;
+  if (pos + num != end) return false;
+  _cp.labels.assign(buf.begin() + pos, buf.begin() + end);
+  return true;
+}
+
+// Captures the state of the volume (all sites are expected to be determined)
+void captureCheckpoint(const Array3D<Presence>& S, Checkpoint& _cp)
+{
+  _cp.problem_hash = problemHash();
+  _cp.sx = S.xsize(); _cp.sy = S.ysize(); _cp.sz = S.zsize();
+  _cp.labels.resize((size_t)_cp.sx * _cp.sy * _cp.sz);
+  size_t n = 0;
+  ForArray3D(S, i, j, k) {
+    int id = 0;
+    ForIndex(l, num_lbls) {
+      if (S.at(i, j, k)[l]) {
+        id = l;
+        break;
+      }
+    }
+    _cp.labels[n++] = (uchar)id;
+  }
+}
+
+// Restores the volume from a checkpoint
+void restoreCheckpoint(const Checkpoint& cp, Array3D<Presence>& _S)
+{
+  _S.allocate(cp.sx, cp.sy, cp.sz);
+  size_t n = 0;
+  ForArray3D(_S, i, j, k) {
+    _S.at(i, j, k).fill(false);
+    _S.at(i, j, k).set(cp.labels[n++], true);
+  }
+}
+
+// Writes checkpoints on a background thread, so that the solver never waits
+// on the disk. Only the latest posted checkpoint is written: if the solver
+// posts faster than the disk goes, intermediate ones are skipped.
+// Files are first written aside then renamed, so the file on disk is always
+// a complete checkpoint. The first failed write is reported on stderr right
+// away, later ones are only counted (see numFailed).
+class CheckpointWriter
+{
+private:
+  string                  m_FileName;
+  std::thread             m_Thread;
+  std::mutex              m_Mutex;
+  std::condition_variable m_Cond;
+  vector<uchar>           m_Pending;
+  bool                    m_HasPending;
+  bool                    m_Quit;
+  std::atomic<int>        m_NumFailed;
+
+  void run()
+  {
+    vector<uchar> data;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Cond.wait(lock, [this]() { return m_HasPending || m_Quit; });
+        if (!m_HasPending) break; // quit, nothing left to write
+        data.swap(m_Pending);
+        m_HasPending = false;
+      }
+      string tmp = m_FileName + ".tmp";
+      string error;
+      FILE *f = fopen(tmp.c_str(), "wb");
+      if (f == NULL) {
+        error = "cannot create " + tmp;
+      } else {
+        bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+        ok = (fclose(f) == 0) && ok;
+        if (!ok) {
+          error = "cannot write " + tmp;
+        } else if (rename(tmp.c_str(), m_FileName.c_str()) != 0) {
+          // some platforms do not replace existing files on rename
+          remove(m_FileName.c_str());
+          if (rename(tmp.c_str(), m_FileName.c_str()) != 0) {
+            error = "cannot rename " + tmp + " to " + m_FileName;
+          }
+        }
+      }
+      if (!error.empty() && m_NumFailed++ == 0) {
+        // (blank line after: the progress display rewrites the last line)
+        std::cerr << sprint("checkpoint: %s (%s)\n\n", error.c_str(), strerror(errno));
+      }
+    }
+  }
+
+public:
+  CheckpointWriter(string fname) : m_FileName(fname), m_HasPending(false), m_Quit(false), m_NumFailed(0)
+  {
+    m_Thread = std::thread([this]() { run(); });
+  }
+  ~CheckpointWriter() { finish(); }
+  // writes the last posted checkpoint (if any) and stops
+  void finish()
+  {
+    if (!m_Thread.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Quit = true;
+    }
+    m_Cond.notify_one();
+    m_Thread.join();
+  }
+  // number of checkpoints that could not be written
+  int numFailed() const { return m_NumFailed; }
+  void post(const Checkpoint& cp)
+  {
+    vector<uchar> data;
+    serializeCheckpoint(cp, data);
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Pending.swap(data);
+      m_HasPending = true;
+    }
+    m_Cond.notify_one();
+  }
+};
+
+// Reads a checkpoint file, returns false if missing or invalid
+bool loadCheckpoint(const char *fname, Checkpoint& _cp)
+{
+  FILE *f = fopen(fname, "rb");
+  if (f == NULL) return false;
+  vector<uchar> data;
+  uchar tmp[4096];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) {
+    data.insert(data.end(), tmp, tmp + n);
+  }
+  fclose(f);
+  return deserializeCheckpoint(data, _cp);
+}
+
+/* -------------------------------------------------------- */
+
+// Counts the number of non empty labels in the entire domain
+int num_solids(Array3D<Presence>& S, int lbl_empty)
+{
+  // num_solids_sub ignores the box border, hence the box one voxel larger than the domain
+  AAB<3, int> all;
+  all.minCorner() = v3i(-1, -1, -1);
+  all.maxCorner() = v3i(S.xsize(), S.ysize(), S.zsize());
+  return num_solids_sub(S, lbl_empty, all);
+}
+
+/* -------------------------------------------------------- */
+
+// Adaptive schedule for solve3D, replacing the fixed number of passes and
+// uniform box sizes:
+// - box sizes are drawn according to the solids they recently brought per
+//   second of synthesis (most accepted boxes bring none, and large boxes
+//   are slower), every size keeping some chance of being drawn,
+// - synthesis stops once the number of solids in the volume grew by less
+//   than 1% over the last c_Window passes.
+// The count of solids goes up and down from pass to pass, so solve3D keeps
+// the volume of the best pass rather than the last one.
+class AdaptiveSchedule
+{
+private:
+  static const int c_MinSize = 8;
+  static const int c_MaxSize = 15;
+  static const int c_Window  = 10; // passes over which progress is measured
+  int         m_Attempts[c_MaxSize + 1];
+  double      m_Gain[c_MaxSize + 1];     // solids brought, decayed at each pass
+  double      m_Seconds[c_MaxSize + 1];  // time spent, decayed at each pass
+  int         m_TotalAttempts;
+  vector<int> m_Solids;            // number of solids after each pass
+
+public:
+  AdaptiveSchedule() : m_TotalAttempts(0)
+  {
+    ForIndex(s, c_MaxSize + 1) { m_Attempts[s] = 0; m_Gain[s] = m_Seconds[s] = 0; }
+  }
+
+  // draws a box size
+  int pickSize(Rng& rnd) const
+  {
+    // sizes not tried yet come first
+    int untried = 0;
+    ForRange(s, c_MinSize, c_MaxSize) {
+      if (m_Attempts[s] == 0) untried++;
+    }
+    if (untried > 0) {
+      int n = rnd.next() % untried;
+      ForRange(s, c_MinSize, c_MaxSize) {
+        if (m_Attempts[s] == 0 && n-- == 0) return s;
+      }
+    }
+    // solids per second, a quarter of the draws being uniform
+    double weights[c_MaxSize + 1];
+    double total = 0;
+    ForRange(s, c_MinSize, c_MaxSize) {
+      weights[s] = m_Seconds[s] > 0 ? max(0.0, m_Gain[s]) / m_Seconds[s] : 0;
+      total += weights[s];
+    }
+    const int num_sizes = c_MaxSize - c_MinSize + 1;
+    ForRange(s, c_MinSize, c_MaxSize) {
+      weights[s] = (total > 0 ? 0.75 * weights[s] / total : 0.75 / num_sizes) + 0.25 / num_sizes;
+    }
+    double r = rnd.next() / 2147483648.0;
+    ForRange(s, c_MinSize, c_MaxSize) {
+      r -= weights[s];
+      if (r < 0) return s;
+    }
+    return c_MaxSize;
+  }
+
+  // gain: solids brought by the box (0 if not accepted, may be negative)
+  void record(int subsz, int gain, double seconds)
+  {
+    m_Attempts[subsz]++;
+    m_Gain[subsz]    += gain;
+    m_Seconds[subsz] += seconds;
+    m_TotalAttempts++;
+  }
+
+  // Call after each pass, returns true once the number of solids grew by
+  // less than 1% over the last c_Window passes. Older statistics fade, as
+  // the best sizes change while the volume fills.
+  bool converged(int solids)
+  {
+    const double decay = 0.8;
+    ForRange(s, c_MinSize, c_MaxSize) {
+      m_Gain[s]    *= decay;
+      m_Seconds[s] *= decay;
+    }
+    m_Solids.push_back(solids);
+    int n = (int)m_Solids.size();
+    if (n <= c_Window) return false;
+    return m_Solids[n - 1] - m_Solids[n - 1 - c_Window] < m_Solids[n - 1] / 100;
+  }
+
+  int totalAttempts() const { return m_TotalAttempts; }
+};
+
+/* -------------------------------------------------------- */
+
+// Coarse spatial statistics of sub-domain attempts, used to place new
+// sub-domains: regions where boxes keep bringing improvements are favored,
+// while regions that repeatedly contradict, or no longer improve, are
+// avoided. Every region keeps a non zero chance of being picked.
+class PlacementHeatmap
+{
+public:
+  enum e_Outcome { Failed, Stale, Improved }; // Stale: rejected or accepted without gain
+
+private:
+  static const int c_CellSize = 4;
+  struct Cell { int attempts, failures, stale, improvements; };
+  Array3D<Cell> m_Cells;
+  int           m_Size; // volume size
+
+  static double weight(const Cell& c)
+  {
+    return (1.0 + c.improvements) / (1.0 + c.failures + 0.5 * c.stale);
+  }
+
+public:
+  PlacementHeatmap(int size) : m_Size(size)
+  {
+    int n = (size + c_CellSize - 1) / c_CellSize;
+    m_Cells.allocate(n, n, n);
+    Cell zero = { 0, 0, 0, 0 };
+    m_Cells.fill(zero);
+  }
+
+  // min corner of a box of size subsz, optionally on the ground (z == 0)
+  v3i pickCorner(int subsz, bool on_ground, Rng& rnd) const
+  {
+    // pick a cell (on the ground layer if needed)
+    int nk = on_ground ? 1 : m_Cells.zsize();
+    double total = 0;
+    ForIndex(k, nk) { ForIndex(j, m_Cells.ysize()) { ForIndex(i, m_Cells.xsize()) {
+      total += weight(m_Cells.at(i, j, k));
+    } } }
+    double r = total * (rnd.next() / 2147483648.0);
+    v3i cell(0, 0, 0);
+    ForIndex(k, nk) { ForIndex(j, m_Cells.ysize()) { ForIndex(i, m_Cells.xsize()) {
+      if (r >= 0) {
+        cell = v3i(i, j, k);
+        r -= weight(m_Cells.at(i, j, k));
+      }
+    } } }
+    // center the box on a random site of the cell
+    v3i corner;
+    ForIndex(c, 3) {
+      int center = cell[c] * c_CellSize + rnd.next() % c_CellSize;
+      corner[c] = max(0, min(m_Size - subsz - 1, center - subsz / 2));
+    }
+    if (on_ground) {
+      corner[2] = 0;
+    }
+    return corner;
+  }
+
+  // records the outcome of an attempt on all cells covered by the box interior
+  void record(AAB<3, int> sub, e_Outcome outcome)
+  {
+    v3i cri = sub.minCorner() + v3i(1, 1, 1);
+    v3i cra = sub.maxCorner() - v3i(1, 1, 1);
+    ForRange(k, cri[2] / c_CellSize, cra[2] / c_CellSize) {
+      ForRange(j, cri[1] / c_CellSize, cra[1] / c_CellSize) {
+        ForRange(i, cri[0] / c_CellSize, cra[0] / c_CellSize) {
+          Cell& c = m_Cells.at(i, j, k);
+          c.attempts++;
+          if (outcome == Failed)   c.failures++;
+          if (outcome == Stale)    c.stale++;
+          if (outcome == Improved) c.improvements++;
+        }
+      }
+    }
+  }
+
+  // Saves the failure rate of each cell as a volume the size of the
+  // synthesized one, to be overlaid on the result: from green (no failures)
+  // to red (only failures). Cells never attempted are left empty.
+  void save(const char *fname) const
+  {
+    Array<v3b> pal;
+    pal.allocate(256);
+    ForIndex(c, 256) {
+      int t = min(c, 100);
+      pal[c] = v3b(255 * t / 100, 255 * (100 - t) / 100, 0);
+    }
+    Array3D<uchar> voxels;
+    voxels.allocate(m_Size, m_Size, m_Size);
+    ForArray3D(voxels, i, j, k) {
+      const Cell& c = m_Cells.at(i / c_CellSize, j / c_CellSize, k / c_CellSize);
+      voxels.at(i, j, k) = c.attempts == 0 ? 255 : (uchar)(1 + 99 * c.failures / c.attempts);
+    }
+    saveVoxels(fname, voxels, pal);
+  }
+};
+
+/* -------------------------------------------------------- */
+
 // Implements model synthesis for a 3D problem
 // This is using the basic building blocks above.
 // The approach used here is similar to Paul Merrell's model
@@ -724,88 +1717,438 @@ void saveAsVoxDetailed(
 // be changed for better/faster results depending on the input problem.
 // Whether everything can be determined automatically is an interesting
 // (and likely difficult) question.
+//
+// The state is checkpointed after passes (see checkpoint_every) and
+// the synthesis can be resumed from the last checkpoint, possibly with
+// a different number of passes.
+//
+// With 'adaptive' the passes follow an AdaptiveSchedule instead, and
+// synthesis stops on convergence or time budget rather than after
+// num_passes (up to a large safety cap).
+// With 'guided' sub-domains are placed according to a PlacementHeatmap,
+// saved in results/heatmap.slab.vox at the end.
 void solve3D()
 {
   Timer tm("solve3D");
-
-  string fullpath = string(SRC_PATH "/exemplars/") + problem + ".slab.vox";
+  auto t_start = std::chrono::steady_clock::now();
 
   //// setup a 3D problem
-  load3DProblem(fullpath.c_str());
+  loadProblem();
 
   // array being synthesized
   Array3D<Presence> S;
-  S.allocate(sz, sz, sz);
 
-  //// init as empty 
-  if (pal2id.find(254) != pal2id.end()) {
-    // ground is being used
-    init_global_empty(S, pal2id[255], pal2id[254]);
+  int num_failed         = 0;
+  int num_success        = 0;
+  int num_attempts       = 0;
+  int num_improvements   = 0; // accepted with more solids
+  // failure reasons
+  int num_contradictions = 0; // constraints cannot be resolved
+  int num_bounded        = 0; // synthesis gave up early, not enough solids possible
+  int num_rejected       = 0; // synthesis completed with not enough solids
+  int first_pass         = 0;
+
+  const char *checkpoint_file = SRC_PATH "/results/checkpoint.bin";
+  if (resume) {
+    //// restart from checkpoint
+    Checkpoint cp;
+    if (!loadCheckpoint(checkpoint_file, cp)) {
+      throw Fatal("cannot resume: no valid checkpoint in %s", checkpoint_file);
+    }
+    if (cp.problem_hash != problemHash()) {
+      throw Fatal("cannot resume: checkpoint is for a different problem or volume size");
+    }
+    restoreCheckpoint(cp, S);
+    seed        = cp.seed; // same random streams as the interrupted run
+    num_failed         = cp.num_failed;
+    num_success        = cp.num_success;
+    num_attempts       = cp.num_attempts;
+    num_improvements   = cp.num_improvements;
+    num_contradictions = cp.num_contradictions;
+    num_bounded        = cp.num_bounded;
+    num_rejected       = cp.num_rejected;
+    first_pass         = cp.pass;
+    std::cerr << sprint("resuming at pass %d / %d (seed %llu)\n\n", first_pass, num_passes, seed);
   } else {
-    // no ground: use an empty border along all faces
-    init_global_empty(S, pal2id[255]);
+    //// init as empty 
+    initVolume(S);
+  }
+
+  // background checkpoint writer
+  std::unique_ptr<CheckpointWriter> checkpoints;
+  if (checkpoint_every >= 0) {
+    checkpoints.reset(new CheckpointWriter(checkpoint_file));
   }
-  
+  auto last_checkpoint = std::chrono::steady_clock::now();
+
+  AdaptiveSchedule schedule;
+  PlacementHeatmap heatmap(sz);
+  int num_done = 0; // passes done in this run
+  // volume of the pass with the most solids (adaptive only, not checkpointed)
+  Array3D<Presence> best;
+  int               best_solids = -1;
+
+  // the adaptive schedule decides when to stop, num_passes does not apply
+  const int adaptive_max_passes = 64 * sz; // safety cap
+  int last_pass = adaptive ? first_pass + adaptive_max_passes - 1 : num_passes - 1;
+
   //// synthesize subsets
-  int num_failed    = 0;
-  int num_success   = 0;
-  int num_passes    = sz; // increases on larger domains.
-  int num_sub_synth = 32; // will use twice that on ground level
-  ForIndex(p, num_passes) {
-    ForIndex(n, p == 0 ? 2 * num_sub_synth : num_sub_synth) {
+  ForRange(p, first_pass, last_pass) {
+    int num_boxes = (p == 0 ? 2 * num_sub_synth : num_sub_synth);
+    ForIndex(n, num_boxes) {
+      auto t_attempt = std::chrono::steady_clock::now();
+      // random stream of this attempt, for placement
+      // (synthesis draws from streams 1 and above, see synthesize_portfolio)
+      Rng rnd(seed, p, n, 0);
       // random size
-      int subsz = min(15, 8 + (rand() % 9));
+      int subsz = adaptive ? schedule.pickSize(rnd) : min(15, 8 + (rnd.next() % 9));
       // random location
       // (forces the first pass to be on the ground, as many problems have ground constraints)
       AAB<3, int> sub;
-      sub.minCorner() = v3i(
-        rand() % (sz - subsz),
-        rand() % (sz - subsz),
-        p == 0 ? 0 : rand() % (sz - subsz));
+      if (guided) {
+        sub.minCorner() = heatmap.pickCorner(subsz, p == 0, rnd);
+      } else {
+        sub.minCorner() = v3i(
+          rnd.next() % (sz - subsz),
+          rnd.next() % (sz - subsz),
+          p == 0 ? 0 : rnd.next() % (sz - subsz));
+      }
       sub.maxCorner() = sub.minCorner() + v3i(subsz, subsz, subsz);
-      // backup current
-      Array3D<Presence> backup = S;
-      // try reseting the subdomain (may fail)
       int num_solids_before = num_solids_sub(S, pal2id[255]/*empty*/, sub);
-      if (reinit_sub(S, pal2id[255], sub)) {
-        // try synthesizing (may fail)
-        int num_solids;
-        if (synthesize(S, pal2id[255]/*empty*/, num_solids, sub)) {
-          if (num_solids >= num_solids_before) { // only accept if less (or eq) non empty appear
-            num_success++;
-          } else {
-            num_failed++;
-            S = backup;
+      bool accepted      = false;
+      bool contradiction = false;
+      bool bounded       = false;
+      bool rejected      = false;
+      if (portfolio_size > 1 && !periodic) {
+        // several candidates race on the sub-domain
+        accepted      = synthesize_portfolio(S, pal2id[255]/*empty*/, sub, num_solids_before, p, n, bounded, rejected);
+        contradiction = !accepted && !bounded && !rejected;
+      } else {
+        // backup current
+        Array3D<Presence> backup = S;
+        // try reseting the subdomain (may fail)
+        if (reinit_sub(S, pal2id[255], sub)) {
+          // try synthesizing (may fail)
+          // (gives up early if the result cannot be accepted)
+          // (same stream as the first candidate of synthesize_portfolio)
+          Rng synth_rnd(seed, p, n, 1);
+          int num_solids;
+          if (synthesize(S, pal2id[255]/*empty*/, num_solids, synth_rnd, sub, NULL, num_solids_before, &bounded)) {
+            // only accept if more (or eq) non empty appear
+            accepted = (num_solids >= num_solids_before);
+          } else if (!bounded) {
+            // synthesis failed: retry
+            contradiction = true;
           }
         } else {
-          // synthesis failed: retry
-          num_failed++;
+          // reinit failed: cannot work here
+          contradiction = true;
+        }
+        if (!accepted) {
           S = backup;
         }
+      }
+      int  gain     = accepted ? num_solids_sub(S, pal2id[255]/*empty*/, sub) - num_solids_before : 0;
+      bool improved = gain > 0;
+      if (accepted) {
+        num_success++;
       } else {
-        // reinit failed: cannot work here 
         num_failed++;
-        S = backup;
+        if (contradiction) {
+          num_contradictions++;
+        } else if (bounded) {
+          num_bounded++;
+        } else {
+          num_rejected++;
+        }
       }
+      if (improved) {
+        num_improvements++;
+      }
+      schedule.record(subsz, gain, std::chrono::duration<double>(std::chrono::steady_clock::now() - t_attempt).count());
+      heatmap.record(sub, contradiction ? PlacementHeatmap::Failed : (improved ? PlacementHeatmap::Improved : PlacementHeatmap::Stale));
+      num_attempts++;
     }
+    num_done++;
     // display progress
     Console::cursorGotoPreviousLineStart();
-    std::cerr << sprint("attempt %3d / %3d, failures: %3d, successes: %3d\n", (p+1) * num_sub_synth, num_sub_synth*num_passes, num_failed, num_success);
+    std::cerr << sprint("pass %3d / %3d, attempts: %4d, failures: %4d (contradictions: %4d, bounded: %4d, rejected: %4d), successes: %4d\n",
+      p + 1, last_pass + 1, num_attempts, num_failed, num_contradictions, num_bounded, num_rejected, num_success);
+    // done?
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    bool stop = (time_budget >= 0 && elapsed >= time_budget);
+    if (adaptive) {
+      int solids = num_solids(S, pal2id[255]/*empty*/);
+      if (solids > best_solids) {
+        best_solids = solids;
+        best        = S;
+      }
+      if (schedule.converged(solids)) {
+        stop = true;
+      }
+    }
+    // checkpoint
+    if (checkpoints) {
+      auto now = std::chrono::steady_clock::now();
+      if (std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_every || p == last_pass || stop) {
+        Checkpoint cp;
+        captureCheckpoint(S, cp);
+        cp.seed               = seed;
+        cp.pass               = p + 1;
+        cp.num_failed         = num_failed;
+        cp.num_success        = num_success;
+        cp.num_attempts       = num_attempts;
+        cp.num_improvements   = num_improvements;
+        cp.num_contradictions = num_contradictions;
+        cp.num_bounded        = num_bounded;
+        cp.num_rejected       = num_rejected;
+        checkpoints->post(cp);
+        last_checkpoint = now;
+      }
+    }
+    if (stop) break;
   }
 
-  // output final
-  saveAsVox(SRC_PATH "/results/synthesized.slab.vox", S);
-  // output detailed if a tilemap exists
-  string low = (string(SRC_PATH "/exemplars/") + tilemap + ".slab.vox");
-  string detailed = (string(SRC_PATH "/exemplars/") + tilemap + "_detailed.slab.vox");
-  if (LibSL::System::File::exists(detailed.c_str())) {
-    saveAsVoxDetailed(
-      low.c_str(),
-      detailed.c_str(),
-      SRC_PATH "/results/synthesized_detailed.slab.vox",
-      S);
+  if (checkpoints) {
+    checkpoints->finish();
+    if (checkpoints->numFailed() > 0) {
+      std::cerr << sprint("checkpoint: %d writes failed, %s may be missing or outdated\n", checkpoints->numFailed(), checkpoint_file);
+    }
+  }
+  if (num_attempts > 0) {
+    std::cerr << sprint("improvements: %d (%.3f per attempt)\n", num_improvements, num_improvements / (double)num_attempts);
+  }
+  portfolio_pool.reset();
+  support_cache.flushStats();
+  long long lookups = support_cache_direct + support_cache_hits + support_cache_misses;
+  if (lookups > 0) {
+    std::cerr << sprint("support cache: %.2f%% hits (%lld direct, %lld hashed, %lld computed)\n",
+      100.0 * (lookups - support_cache_misses) / lookups,
+      (long long)support_cache_direct, (long long)support_cache_hits, (long long)support_cache_misses);
+  }
+  if (guided) {
+    heatmap.save(SRC_PATH "/results/heatmap.slab.vox");
+  }
+
+  if (adaptive && best_solids >= 0) {
+    S = best;
+    // (to compare, run the same seed without -adaptive)
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    std::cerr << sprint("adaptive: %d passes, %d attempts, %.2f s, %d solids\n", num_done, schedule.totalAttempts(), elapsed, best_solids);
   }
 
+  // output
+  saveResults(S);
+
+}
+
+/* -------------------------------------------------------- */
+
+// Resynthesizes the box [a,b] (inclusive), keeping pinned sites and the
+// one voxel halo around the box untouched. Large boxes are processed in
+// small chunks, which are much more likely to be resolved.
+// Returns true on success. On failure, the entire box is restored to its
+// previous state: an edit is either fully applied or not at all.
+// Random streams are identified by the request number.
+bool resynthesize_box(Array3D<Presence>& S, const Array3D<uchar>& pinned, int lbl_empty, v3i a, v3i b, int request)
+{
+  int num_chunks = 0;
+  const int chunk        = 8;  // interior size of a chunk
+  const int max_attempts = 64; // attempts per chunk before giving up
+  // backup the box and its halo, restored if any chunk fails
+  AAB<3, int> all;
+  all.minCorner() = v3i(max(a[0] - 1, 0), max(a[1] - 1, 0), max(a[2] - 1, 0));
+  all.maxCorner() = v3i(min(b[0] + 1, (int)S.xsize() - 1), min(b[1] + 1, (int)S.ysize() - 1), min(b[2] + 1, (int)S.zsize() - 1));
+  Array3D<Presence> all_backup;
+  extract_sub(S, all, all_backup);
+  for (int ck = a[2]; ck <= b[2]; ck += chunk) {
+    for (int cj = a[1]; cj <= b[1]; cj += chunk) {
+      for (int ci = a[0]; ci <= b[0]; ci += chunk) {
+        // chunk interior and its halo, clamped to the domain
+        v3i cmin = v3i(ci, cj, ck);
+        v3i cmax = v3i(min(ci + chunk - 1, b[0]), min(cj + chunk - 1, b[1]), min(ck + chunk - 1, b[2]));
+        AAB<3, int> sub;
+        sub.minCorner() = v3i(max(cmin[0] - 1, 0), max(cmin[1] - 1, 0), max(cmin[2] - 1, 0));
+        sub.maxCorner() = v3i(min(cmax[0] + 1, (int)S.xsize() - 1), min(cmax[1] + 1, (int)S.ysize() - 1), min(cmax[2] + 1, (int)S.zsize() - 1));
+        // backup the chunk only
+        Array3D<Presence> backup;
+        extract_sub(S, sub, backup);
+        bool ok = false;
+        ForIndex(t, max_attempts) {
+          if (!reinit_sub(S, lbl_empty, sub, &pinned)) {
+            paste_sub(backup, sub, S);
+            break; // reinit is deterministic, it would fail again
+          }
+          Rng rnd(seed, request, num_chunks, t);
+          int num_solids;
+          if (synthesize(S, lbl_empty, num_solids, rnd, sub)) {
+            ok = true;
+            break;
+          }
+          paste_sub(backup, sub, S);
+        }
+        if (!ok) {
+          paste_sub(all_backup, all, S);
+          return false;
+        }
+        num_chunks++;
+      }
+    }
+  }
+  return true;
+}
+
+/* -------------------------------------------------------- */
+
+// Checks that every site of the box is compatible with its neighbors,
+// in a volume where all sites are determined
+bool consistent_sub(const Array3D<Presence>& S, v3i a, v3i b)
+{
+  ForRange(k, a[2], b[2]) { ForRange(j, a[1], b[1]) { ForRange(i, a[0], b[0]) {
+    int l1 = 0;
+    while (l1 < num_lbls && !S.at(i, j, k)[l1]) l1++;
+    if (l1 == num_lbls) return false;
+    ForIndex(n, 6) {
+      v3i ne = v3i(i + neighs[n][0], j + neighs[n][1], k + neighs[n][2]);
+      if (!periodic
+        && (ne[0] < 0 || ne[0] >= (int)S.xsize()
+         || ne[1] < 0 || ne[1] >= (int)S.ysize()
+         || ne[2] < 0 || ne[2] >= (int)S.zsize())) {
+        continue; // out of domain
+      }
+      const Presence& from_neigh = S.at<Wrap>(ne[0], ne[1], ne[2]);
+      bool allowed = false;
+      for (int l2 : allowed_by_side[n][l1]) {
+        allowed = allowed || from_neigh[l2];
+      }
+      if (!allowed) return false;
+    }
+  } } }
+  return true;
+}
+
+/* -------------------------------------------------------- */
+
+// Interactive mode: keeps the problem and volume resident and applies
+// edit commands read from stdin, one per line:
+//   pin     x0 y0 z0 x1 y1 z1 pal  sets palette index 'pal' in the box and locks it
+//   unpin   x0 y0 z0 x1 y1 z1      unlocks the box
+//   clear   x0 y0 z0 x1 y1 z1      erases the box (empty label, unlocked)
+//   resynth x0 y0 z0 x1 y1 z1      resynthesizes the box, within its halo
+//   export  [file]                 saves the volume (default: results/)
+//   reset                          back to the initial, empty volume
+//   quit
+// After a pin or clear, the surroundings of the box are resynthesized if
+// they no longer agree with it, within a halo that doubles until they do
+// (removing the base of a tower may require removing what stands above).
+// If even the whole volume cannot be made to agree the edit is rejected,
+// so the volume always remains valid.
+// Each command is answered on stdout by 'ok <cmd> <latency> ms' or
+// 'error <cmd> <latency> ms: <reason>'. On error the volume is unchanged.
+void serve3D()
+{
+  //// setup a 3D problem
+  loadProblem();
+  int lbl_empty = pal2id[255];
+
+  // resident volume and pinned sites
+  Array3D<Presence> S;
+  initVolume(S);
+  Array3D<uchar> pinned;
+  pinned.allocate(sz, sz, sz);
+  pinned.fill(0);
+
+  // sites around an edited box first resynthesized to agree with it
+  const int edit_halo = 2;
+
+  std::cerr << sprint("server ready (%d^3 volume, %d labels)\n", sz, num_lbls);
+
+  int num_requests = 0;
+  string line;
+  while (getline(cin, line)) {
+    istringstream in(line);
+    string cmd;
+    in >> cmd;
+    if (cmd.empty()) continue;
+    if (cmd == "quit") break;
+    num_requests++;
+    auto t_start = std::chrono::steady_clock::now();
+    string error;
+    if (cmd == "pin" || cmd == "unpin" || cmd == "clear" || cmd == "resynth") {
+      // read box
+      v3i a, b;
+      in >> a[0] >> a[1] >> a[2] >> b[0] >> b[1] >> b[2];
+      int pal = 255;
+      if (cmd == "pin") {
+        in >> pal;
+      }
+      ForIndex(c, 3) {
+        if (a[c] > b[c]) std::swap(a[c], b[c]);
+      }
+      if (in.fail()) {
+        error = "expected: " + cmd + " x0 y0 z0 x1 y1 z1" + (cmd == "pin" ? " pal" : "");
+      } else if (a[0] < 0 || a[1] < 0 || a[2] < 0 || b[0] >= sz || b[1] >= sz || b[2] >= sz) {
+        error = "box outside of volume";
+      } else if (pal < 0 || pal > 255 || pal2id.find((uchar)pal) == pal2id.end()) {
+        error = "unknown palette index";
+      } else if (cmd == "resynth") {
+        if (!resynthesize_box(S, pinned, lbl_empty, a, b, num_requests)) {
+          error = "constraints cannot be resolved in box";
+        }
+      } else {
+        Array3D<Presence> S_before      = S;
+        Array3D<uchar>    pinned_before = pinned;
+        // the edited box is kept while its surroundings adapt (even when cleared)
+        Array3D<uchar>    keep          = pinned;
+        ForRange(k, a[2], b[2]) { ForRange(j, a[1], b[1]) { ForRange(i, a[0], b[0]) {
+          if (cmd != "unpin") {
+            S.at(i, j, k).fill(false);
+            S.at(i, j, k).set(pal2id[(uchar)pal], true);
+          }
+          pinned.at(i, j, k) = (cmd == "pin");
+          keep.at(i, j, k)   = 1;
+        } } }
+        if (cmd != "unpin") {
+          v3i ha = v3i(max(a[0] - edit_halo, 0), max(a[1] - edit_halo, 0), max(a[2] - edit_halo, 0));
+          v3i hb = v3i(min(b[0] + edit_halo, sz - 1), min(b[1] + edit_halo, sz - 1), min(b[2] + edit_halo, sz - 1));
+          if (!consistent_sub(S, ha, hb)) {
+            // grow the halo until the surroundings agree, up to the whole volume
+            bool ok = false;
+            for (int halo = edit_halo; !ok; halo *= 2) {
+              ha = v3i(max(a[0] - halo, 0), max(a[1] - halo, 0), max(a[2] - halo, 0));
+              hb = v3i(min(b[0] + halo, sz - 1), min(b[1] + halo, sz - 1), min(b[2] + halo, sz - 1));
+              ok = resynthesize_box(S, keep, lbl_empty, ha, hb, num_requests);
+              if (halo >= sz) break; // whole volume
+            }
+            if (!ok) {
+              S      = S_before;
+              pinned = pinned_before;
+              error  = "edit contradicts its surroundings, rejected";
+            }
+          }
+        }
+      }
+    } else if (cmd == "export") {
+      string fname;
+      in >> fname;
+      if (fname.empty()) {
+        saveResults(S);
+      } else {
+        saveAsVox(fname.c_str(), S);
+      }
+    } else if (cmd == "reset") {
+      initVolume(S);
+      pinned.fill(0);
+    } else {
+      error = "unknown command '" + cmd + "'";
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    if (error.empty()) {
+      std::cout << "ok " << cmd << sprint(" %.3f ms", ms) << std::endl;
+    } else {
+      std::cout << "error " << cmd << sprint(" %.3f ms: ", ms) << error << std::endl;
+    }
+  }
 }
 
 /* -------------------------------------------------------- */
@@ -815,12 +2158,54 @@ int main(int argc, char **argv)
 {
   try {
 
+    // options
+    bool server   = false;
+    bool has_seed = false;
+    num_threads   = max(1, (int)std::thread::hardware_concurrency());
+    ForRange(a, 1, argc - 1) {
+      if (!strcmp(argv[a], "-server")) {
+        server = true; // interactive mode, see serve3D
+      } else if (!strcmp(argv[a], "-portfolio") && a + 1 < argc) {
+        portfolio_size = max(1, atoi(argv[++a])); // candidates per sub-domain, see synthesize_portfolio
+      } else if (!strcmp(argv[a], "-threads") && a + 1 < argc) {
+        num_threads = max(1, atoi(argv[++a]));
+      } else if (!strcmp(argv[a], "-seed") && a + 1 < argc) {
+        seed = strtoull(argv[++a], NULL, 10);
+        has_seed = true;
+      } else if (!strcmp(argv[a], "-passes") && a + 1 < argc) {
+        num_passes = max(1, atoi(argv[++a]));
+      } else if (!strcmp(argv[a], "-subsynth") && a + 1 < argc) {
+        num_sub_synth = max(1, atoi(argv[++a]));
+      } else if (!strcmp(argv[a], "-checkpoint") && a + 1 < argc) {
+        checkpoint_every = max(0.0, atof(argv[++a])); // seconds
+      } else if (!strcmp(argv[a], "-resume")) {
+        resume = true;
+      } else if (!strcmp(argv[a], "-adaptive")) {
+        adaptive = true;
+      } else if (!strcmp(argv[a], "-budget") && a + 1 < argc) {
+        time_budget = max(0.0, atof(argv[++a])); // seconds
+      } else if (!strcmp(argv[a], "-guided")) {
+        guided = true;
+      } else if (!strcmp(argv[a], "-problem") && a + 1 < argc) {
+        problem = argv[++a];
+      } else {
+        throw Fatal("unknown option '%s' (usage: VoxModSynth [-problem <name>] [-seed <n>] [-server] [-portfolio <candidates>] [-threads <n>] [-passes <n>] [-subsynth <n>] [-checkpoint <seconds>] [-resume] [-adaptive] [-budget <seconds>] [-guided])", argv[a]);
+      }
+    }
+
     // random seed
-    srand((unsigned int)time(NULL));
+    if (!has_seed) {
+      seed = (unsigned long long)time(NULL);
+    }
+    std::cerr << sprint("seed %llu\n", seed);
     
-    // let's synthesize!
-    std::cerr << Console::white << "Synthesizing a voxel model!" << Console::gray << std::endl << std::endl;
-    solve3D();
+    if (server) {
+      serve3D();
+    } else {
+      // let's synthesize!
+      std::cerr << Console::white << "Synthesizing a voxel model!" << Console::gray << std::endl << std::endl;
+      solve3D();
+    }
 
   } catch (Fatal& e) {
     std::cerr << Console::red << e.message() << Console::gray << std::endl;